@@ -8,16 +8,21 @@ tutorial by Saeed Hosseini @ Electropeak
 
 Pin-outs on my mega2560 (clone):
 
+Pin 11: Cam trigger wheel output
+Pin 12: Stroboscope trigger output (OC1B, HIGH = flash)
+Pin 13: Crank trigger wheel output (OC1C)
 Pin 22: Fuel pump relay (HIGH = pump off)
-Pin 50 - 53: Injectors 
+Pin 23: Awake probe, built with -DAWAKE_PROBE (HIGH while the CPU is awake, LOW while it sleeps)
+Pin 50 - 53: Injectors 1 - 4 (see INJECTORS)
+Pin A8 - A11: Captured injector signals from an ECU (LOW = injector open)
 
 
 */
 #include <Arduino.h>
+#include <avr/sleep.h>
 #include <EEPROM.h>
 #include <LiquidCrystal.h>
 #include <string.h>
-#include <stdio.h>
 
 //LCD pin to Arduino
 const int pin_RS = 8; 
@@ -30,14 +35,104 @@ const int pin_BL = 10;
 
 // fuel pump relay pin - mega pin 40
 const uint8_t pin_FUEL_PUMP_RELAY = 22;
-// injector pins - mega pins 50 through to 53
-const uint8_t pin_INJECTOR_1_MASK = B00001000;  // pin 50
-const uint8_t pin_INJECTOR_2_MASK = B00000100;  // pin 51
-const uint8_t pin_INJECTOR_3_MASK = B00000010;  // pin 52
-const uint8_t pin_INJECTOR_4_MASK = B00000001;  // pin 53
 
-// Make PORTB pins 50 - 53 outputs
-const uint8_t dir_INJECTORS_OUT = B00001111;
+// awake probe pin - mega pin 23 is PA1. Put a scope on it to see how long
+// after an interrupt the main code gets going, and (from its duty cycle) how
+// much of the time the CPU sleeps. It switches a few thousand times a second,
+// so it's only built in with -DAWAKE_PROBE
+#ifdef AWAKE_PROBE
+const uint8_t pin_AWAKE_MASK = _BV(PA1);
+#else
+const uint8_t pin_AWAKE_MASK = 0;
+#endif
+
+// strobe trigger pin - mega pin 12 is PB6, the hardware OC1B output of timer1
+const uint8_t pin_STROBE_MASK = _BV(PB6);
+
+// trigger wheel pins - mega pin 13 is PB7, the hardware OC1C output of timer1,
+// and mega pin 11 is PB5
+const uint8_t pin_CRANK_MASK = _BV(PB7);
+const uint8_t pin_CAM_MASK = _BV(PB5);
+
+/* Injector channel map
+
+   The injectors all have to be on one 8 bit port, so that any set of them is
+   switched on or off with a single port write. The port, and the bit each
+   injector is on, are fixed at compile time by the INJECTORS typedef below.
+   The pulse engine, replay, the injector selection and the saved settings
+   all size themselves from it. Each port lists the bits already used for
+   something else, and a map that lands on one of them won't compile. */
+
+// mega pins 22 through to 29, less the pump relay and the awake probe (a
+// zero mask unless AWAKE_PROBE is defined)
+struct port_a {
+  static volatile uint8_t &port() { return PORTA; }
+  static volatile uint8_t &ddr() { return DDRA; }
+  static const uint8_t reserved = _BV(PA0) | pin_AWAKE_MASK;
+};
+
+// mega pins 53 through to 50. PB4 is mega pin 10, the LCD backlight (pin_BL),
+// and the rest are the strobe and trigger wheel
+struct port_b {
+  static volatile uint8_t &port() { return PORTB; }
+  static volatile uint8_t &ddr() { return DDRB; }
+  static const uint8_t reserved = _BV(PB4) | pin_STROBE_MASK | pin_CRANK_MASK | pin_CAM_MASK;
+};
+
+// mega pins 37 through to 30
+struct port_c {
+  static volatile uint8_t &port() { return PORTC; }
+  static volatile uint8_t &ddr() { return DDRC; }
+  static const uint8_t reserved = 0;
+};
+
+// mega pins 49 through to 42
+struct port_l {
+  static volatile uint8_t &port() { return PORTL; }
+  static volatile uint8_t &ddr() { return DDRL; }
+  static const uint8_t reserved = 0;
+};
+
+constexpr uint8_t bits_mask() { return 0; }
+
+template <typename... T>
+constexpr uint8_t bits_mask(uint8_t bit, T... rest) { return _BV(bit) | bits_mask(rest...); }
+
+constexpr uint8_t bits_count(uint8_t mask) { return mask ? (mask & 1) + bits_count(mask >> 1) : 0; }
+
+/* BITS are the port bits of injector 1, 2, ... in that order */
+template <typename PORT, uint8_t... BITS>
+struct injector_map {
+  static const uint8_t count = sizeof...(BITS);
+  static const uint8_t all = bits_mask(BITS...);
+  static const uint8_t masks[count];
+
+  static_assert(count > 0, "need at least one injector");
+  static_assert(bits_count(all) == count, "injectors have to be on different bits");
+  static_assert((all & PORT::reserved) == 0, "injector on a pin that is already in use");
+
+  static volatile uint8_t &port() { return PORT::port(); }
+  static volatile uint8_t &ddr() { return PORT::ddr(); }
+};
+
+template <typename PORT, uint8_t... BITS>
+const uint8_t injector_map<PORT, BITS...>::masks[] = { _BV(BITS)... };
+
+// injector pins - mega pins 50 through to 53. An eight cylinder rail fits
+// on PORTC:
+//   typedef injector_map<port_c, PC7, PC6, PC5, PC4, PC3, PC2, PC1, PC0> INJECTORS;
+typedef injector_map<port_b, PB3, PB2, PB1, PB0> INJECTORS;
+
+// captured injector inputs - mega pins A8 through to A11 are PK0 - PK3. Each
+// channel is replayed on the injector of the same number, if there is one
+const uint8_t pin_CAPTURE_MASK = B00001111;
+const uint8_t CAPTURE_CHANNELS = 4;
+
+/* timer1 runs at 16MHz / 8, so one tick is half a microsecond */
+const long TICKS_PER_US = 2;
+
+/* how long the strobe trigger pin is held high for each flash */
+const long STROBE_PULSE_US = 50;
 
 typedef struct leak_test_params {
   int seconds;
@@ -80,11 +175,59 @@ typedef struct {
   long long microsecond_step;
 } pwm_params;
 
+typedef struct {
+  long delay_us;
+  long max_delay_us;
+  long min_delay_us;
+  long delay_step;
+  int drift_us;
+  int max_drift_us;
+  int min_drift_us;
+  int drift_step;
+} strobe_params;
+
+typedef struct {
+  int pattern;
+  int max_pattern;
+  int min_pattern;
+  int pattern_step;
+} trigger_params;
+
+typedef struct {
+  int seconds;
+  int max_seconds;
+  int min_seconds;
+  int second_step;
+} capture_params;
+
+typedef struct {
+  int selected;         // 0 for all injectors, otherwise the one injector to drive
+  int max_selected;
+  int min_selected;
+  int selected_step;
+} injector_params;
+
+/* A missing-tooth crank wheel with a single tooth cam wheel. The cam tooth is
+   given in crank teeth over the whole 720 degree cycle, and has to start and
+   end on teeth that aren't missing */
+typedef struct {
+  const char *name;
+  uint8_t teeth;        // tooth positions per revolution, missing ones included
+  uint8_t missing;      // missing teeth at the end of each revolution
+  uint8_t cam_tooth;    // crank tooth the cam tooth starts on
+  uint8_t cam_width;    // crank teeth the cam tooth lasts
+} trigger_pattern;
+
 typedef enum {
   LEAK_TEST,
   RPM_MODE,
   FULL_FLOW_MODE,
   PWM_MODE,
+  TRIGGER_MODE,
+  CAPTURE_MODE,
+  REPLAY_MODE,
+  INJECTOR_MODE,
+  STROBE_MODE,
   NO_MODE
 } operation_t;
 
@@ -147,6 +290,37 @@ pwm_params PWM_PARAMS = { .pulses = 30,
                           .min_microseconds = 100, // 0.1ms
                           .microsecond_step = 10 // 0.01ms
                           }; /* 100 pulses @ 5ms */
+strobe_params STROBE_PARAMS = { .delay_us = 1000,
+                                .max_delay_us = 100000, // 100ms
+                                .min_delay_us = 100,    // 0.1ms
+                                .delay_step = 50,
+                                .drift_us = 0,          // no slow motion
+                                .max_drift_us = 500,
+                                .min_drift_us = 0,
+                                .drift_step = 10 };
+
+/* the trigger wheels the tester can generate */
+const trigger_pattern TRIGGER_PATTERNS[] = {
+  { .name = "60-2", .teeth = 60, .missing = 2, .cam_tooth = 10, .cam_width = 10 },
+  { .name = "36-1", .teeth = 36, .missing = 1, .cam_tooth = 6,  .cam_width = 6 },
+  { .name = "36-2", .teeth = 36, .missing = 2, .cam_tooth = 6,  .cam_width = 6 },
+  { .name = "24-1", .teeth = 24, .missing = 1, .cam_tooth = 4,  .cam_width = 4 },
+  { .name = "12-1", .teeth = 12, .missing = 1, .cam_tooth = 2,  .cam_width = 2 },
+};
+const int TRIGGER_PATTERN_COUNT = sizeof(TRIGGER_PATTERNS) / sizeof(TRIGGER_PATTERNS[0]);
+
+trigger_params TRIGGER_PARAMS = { .pattern = 0,
+                                  .max_pattern = TRIGGER_PATTERN_COUNT - 1,
+                                  .min_pattern = 0,
+                                  .pattern_step = 1 };
+capture_params CAPTURE_PARAMS = { .seconds = 30,
+                                  .max_seconds = 60,
+                                  .min_seconds = 5,
+                                  .second_step = 5 };
+injector_params INJECTOR_PARAMS = { .selected = 0,
+                                    .max_selected = INJECTORS::count,
+                                    .min_selected = 0,
+                                    .selected_step = 1 };
 
 
 /* User interface:
@@ -158,6 +332,7 @@ pwm_params PWM_PARAMS = { .pulses = 30,
  *   
  *    RPM mode:
  *      Simulate X RPM. Open injectors for nn% of duty cycle
+ *      UP / DOWN change the rpm, or the duty after LEFT, while it runs
  *      
  *    Full flow mode:
  *      Keep injectors fully open for x seconds
@@ -165,6 +340,24 @@ pwm_params PWM_PARAMS = { .pulses = 30,
  *    PWM mode:
  *      Open injectors for x.y milliseconds, n times.
  *      
+ *    Trigger wheel mode:
+ *      RPM mode, while also outputting crank and cam trigger wheel signals
+ *      in step with the injector pulses
+ *      
+ *    Capture mode:
+ *      Record the injector signals of an ECU for up to x seconds, or until
+ *      a button is pressed. Only the latest edges are kept once memory runs out
+ *      
+ *    Replay mode:
+ *      Run the pump and drive the injectors with the captured signals
+ *      
+ *    Injector setup:
+ *      Drive all the injectors, or just injector n, in the other modes
+ *      
+ *    Strobe setup:
+ *      Fire the strobe x.y milliseconds after each injector opening in RPM
+ *      and PWM modes, moving the flash n microseconds later every cycle
+ *      
  *      
  *      
  * Status line:      ________________
@@ -176,45 +369,185 @@ pwm_params PWM_PARAMS = { .pulses = 30,
  *    
  *    PWM mode:      10s@1.2ms     12
  *    
+ *    Trigger wheel: 60-2 1000rpm    12
+ *    
+ *    Capture mode:  xx s          12
+ *    
+ *    Replay mode:   123 edges       12
+ *    
+ *    Injector setup: all 4 injectors 12
+ *    
+ *    Strobe setup:  1.00ms 10us     12
+ *    
  */
 
 
 LiquidCrystal lcd( pin_RS,  pin_EN,  pin_d4,  pin_d5,  pin_d6,  pin_d7);
 
+/********************************************/
+
+/* Formatters
+
+   Small replacements for snprintf, which drags in all of vfprintf and takes
+   hundreds of microseconds a call. Each one writes at p and returns where it
+   stopped, so a line is built by chaining them:
+
+     char *p = fmt_str(buf, "IPW: ");
+     p = fmt_fixed(p, injector_open_time, 3, 2);   // 1234us -> "1.23"
+     p = fmt_str(p, "ms");
+     fmt_line(buf, p, 16);
+
+   Nothing is bounds checked, buffers have to be big enough for what goes in */
+
+char *fmt_str(char *p, const char *s)
+{
+  while (*s) {
+    *p++ = *s++;
+  }
+  return p;
+}
+
+
+char *fmt_uint(char *p, uint32_t v)
+{
+  char digits[10];
+  uint8_t n = 0;
+
+  /* 16 bit divisions are much cheaper on the AVR, only do 32 bit ones while needed */
+  while (v > 0xFFFF) {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  }
+  uint16_t w = v;
+  do {
+    digits[n++] = '0' + w % 10;
+    w /= 10;
+  } while (w);
+
+  while (n) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+
+char *fmt_int(char *p, long v)
+{
+  if (v < 0) {
+    *p++ = '-';
+    return fmt_uint(p, -(uint32_t)v);
+  }
+  return fmt_uint(p, v);
+}
+
+
+/* Write v / 10^scale with the given number of decimals (truncated), for example
+   fmt_fixed(p, 1234, 3, 2) writes "1.23" */
+char *fmt_fixed(char *p, long v, uint8_t scale, uint8_t decimals)
+{
+  uint32_t u = v;
+  if (v < 0) {
+    *p++ = '-';
+    u = -(uint32_t)v;
+  }
+
+  uint32_t div = 1;
+  for (uint8_t i = 0; i < scale; i++) {
+    div *= 10;
+  }
+  p = fmt_uint(p, u / div);
+
+  if (decimals) {
+    *p++ = '.';
+    uint32_t frac = u % div;
+    for (uint8_t i = 0; i < decimals; i++) {
+      div /= 10;
+      *p++ = '0' + frac / div;
+      frac %= div;
+    }
+  }
+  return p;
+}
+
+
+/* Terminate the string */
+char *fmt_end(char *p)
+{
+  *p = '\0';
+  return p;
+}
+
+
+/* Pad the line started at buf with spaces, or cut it, to exactly width characters */
+void fmt_line(char *buf, char *p, uint8_t width)
+{
+  while (p < buf + width) {
+    *p++ = ' ';
+  }
+  buf[width] = '\0';
+}
+
+
+/********************************************/
+
 /* display the top line on the LCD */
 void set_top_line(operation_t mode) 
 {
-  char buf[17];
+  const char *title;
   switch(mode) {
     case LEAK_TEST:
-      snprintf(buf, sizeof(buf),"Leak Test Mode  ");
+      title = "Leak Test Mode  ";
       break;
       ;;
     case RPM_MODE:
-      snprintf(buf, sizeof(buf),"RPM Mode        ");
+      title = "RPM Mode        ";
       break;
       ;;
     case FULL_FLOW_MODE:
-      snprintf(buf, sizeof(buf),"Full Flow Mode  ");
+      title = "Full Flow Mode  ";
       break;
       ;;
     case PWM_MODE:
-      snprintf(buf, sizeof(buf),"PWM Mode        ");   
+      title = "PWM Mode        ";
+      break;
+      ;;
+    case TRIGGER_MODE:
+      title = "Trigger Wheel   ";
+      break;
+      ;;
+    case CAPTURE_MODE:
+      title = "Capture Mode    ";
+      break;
+      ;;
+    case REPLAY_MODE:
+      title = "Replay Mode     ";
+      break;
+      ;;
+    case INJECTOR_MODE:
+      title = "Injector Setup  ";
+      break;
+      ;;
+    case STROBE_MODE:
+      title = "Strobe Setup    ";
       break;
       ;;
     default:
-      snprintf(buf, sizeof(buf),"Unknown mode    "); 
+      title = "Unknown mode    ";
   }
   lcd.setCursor(0,0);
-  lcd.print(buf);
+  lcd.print(title);
 }
 
 
+/* defined with the capture buffer further down */
+long capture_event_count();
+
 /* Display the bottom line on the LCD (at least in menu mode) */
 void set_bottom_line(operation_t mode, button_t button)
 {
     /* Print bottom line */
-    char buf[17];
+    char buf[24];
+    char *p = buf;
 
     /* the pN_markers are used to show the user which parameter
        he/she can currently modify */
@@ -223,38 +556,94 @@ void set_bottom_line(operation_t mode, button_t button)
     const char *p2_marker = PARAM_NUM == 2 ? ">" : " ";
     switch (mode) {
       case LEAK_TEST:
-        snprintf(buf, sizeof(buf), ">%d seconds      ", 
-                 LEAK_TEST_PARAMS.seconds); 
+        p = fmt_str(p, ">");
+        p = fmt_int(p, LEAK_TEST_PARAMS.seconds);
+        p = fmt_str(p, " seconds");
         break;
         ;;
       case FULL_FLOW_MODE:
-        snprintf(buf, sizeof(buf), ">%d seconds      ", 
-                 FULL_FLOW_PARAMS.seconds); 
+        p = fmt_str(p, ">");
+        p = fmt_int(p, FULL_FLOW_PARAMS.seconds);
+        p = fmt_str(p, " seconds");
         break;
         ;;
       case RPM_MODE:
         // example: ">60s 1000rpm 75%"
-        snprintf(buf, sizeof(buf), "%s%ds%s%drpm%s%d%%     ", 
-                 p0_marker, RPM_MODE_PARAMS.seconds, p1_marker, 
-                 RPM_MODE_PARAMS.rpm, p2_marker, RPM_MODE_PARAMS.duty); 
+        p = fmt_str(p, p0_marker);
+        p = fmt_int(p, RPM_MODE_PARAMS.seconds);
+        p = fmt_str(p, "s");
+        p = fmt_str(p, p1_marker);
+        p = fmt_int(p, RPM_MODE_PARAMS.rpm);
+        p = fmt_str(p, "rpm");
+        p = fmt_str(p, p2_marker);
+        p = fmt_int(p, RPM_MODE_PARAMS.duty);
+        p = fmt_str(p, "%");
         break;
         ;;
       case PWM_MODE:
-        long long us = PWM_PARAMS.microseconds;
-        long us_big = (long)((long long)us / (long long)1000);
-        long us_small = (us % 1000) / 10;
-
         // example: ">100p 1.23ms"
-        snprintf(buf, sizeof(buf), "%s%dp %s%d.%02dms     ", 
-                 p0_marker, PWM_PARAMS.pulses,
-                 p1_marker, (int)us_big, (int)us_small);
+        p = fmt_str(p, p0_marker);
+        p = fmt_int(p, PWM_PARAMS.pulses);
+        p = fmt_str(p, "p ");
+        p = fmt_str(p, p1_marker);
+        p = fmt_fixed(p, (long)PWM_PARAMS.microseconds, 3, 2);
+        p = fmt_str(p, "ms");
+        break;
+        ;;
+      case TRIGGER_MODE:
+        // example: ">60-2 1000rpm"
+        p = fmt_str(p, p0_marker);
+        p = fmt_str(p, TRIGGER_PATTERNS[TRIGGER_PARAMS.pattern].name);
+        p = fmt_str(p, " ");
+        p = fmt_str(p, p1_marker);
+        p = fmt_int(p, RPM_MODE_PARAMS.rpm);
+        p = fmt_str(p, "rpm");
+        break;
+        ;;
+      case CAPTURE_MODE:
+        p = fmt_str(p, ">");
+        p = fmt_int(p, CAPTURE_PARAMS.seconds);
+        p = fmt_str(p, " seconds");
+        break;
+        ;;
+      case REPLAY_MODE:
+        // example: "1234 edges"
+        p = fmt_int(p, capture_event_count());
+        p = fmt_str(p, " edges");
+        break;
+        ;;
+      case INJECTOR_MODE:
+        // example: ">all 4 injectors" or ">injector 3"
+        if (INJECTOR_PARAMS.selected == 0) {
+          p = fmt_str(p, ">all ");
+          p = fmt_int(p, INJECTORS::count);
+          p = fmt_str(p, " injectors");
+        } else {
+          p = fmt_str(p, ">injector ");
+          p = fmt_int(p, INJECTOR_PARAMS.selected);
+        }
+        break;
+        ;;
+      case STROBE_MODE:
+        // example: ">1.25ms  10us"
+        p = fmt_str(p, p0_marker);
+        p = fmt_fixed(p, STROBE_PARAMS.delay_us, 3, 2);
+        p = fmt_str(p, "ms ");
+        p = fmt_str(p, p1_marker);
+        p = fmt_int(p, STROBE_PARAMS.drift_us);
+        p = fmt_str(p, "us");
         break;
         ;;
       default:
-        snprintf(buf, sizeof(buf), "b %s%d  p %s%l         ", 
-                 p0_marker, button, p1_marker, PARAM_NUM); 
+        p = fmt_str(p, "b ");
+        p = fmt_str(p, p0_marker);
+        p = fmt_int(p, button);
+        p = fmt_str(p, "  p ");
+        p = fmt_str(p, p1_marker);
+        p = fmt_int(p, PARAM_NUM);
         ;;
     }
+    fmt_line(buf, p, 16);
     lcd.setCursor(0,1);
     lcd.print(buf);
 }
@@ -281,6 +670,11 @@ void save_settings(bool immediate)
       int         full_flow.seconds
       int         pwm_mode.pulses
       long long   pwm_mode.microseconds
+      long        strobe.delay_us
+      int         strobe.drift_us
+      int         trigger.pattern
+      int         capture.seconds
+      int         injector.selected
   */
 
   int eadr = 0;
@@ -306,6 +700,24 @@ void save_settings(bool immediate)
   eadr += sizeof(PWM_PARAMS.pulses);
   EEPROM.put(eadr, PWM_PARAMS.microseconds);
   eadr += sizeof(PWM_PARAMS.microseconds);
+
+  /* strobe */
+  EEPROM.put(eadr, STROBE_PARAMS.delay_us);
+  eadr += sizeof(STROBE_PARAMS.delay_us);
+  EEPROM.put(eadr, STROBE_PARAMS.drift_us);
+  eadr += sizeof(STROBE_PARAMS.drift_us);
+
+  /* trigger wheel */
+  EEPROM.put(eadr, TRIGGER_PARAMS.pattern);
+  eadr += sizeof(TRIGGER_PARAMS.pattern);
+
+  /* capture mode */
+  EEPROM.put(eadr, CAPTURE_PARAMS.seconds);
+  eadr += sizeof(CAPTURE_PARAMS.seconds);
+
+  /* injector selection */
+  EEPROM.put(eadr, INJECTOR_PARAMS.selected);
+  eadr += sizeof(INJECTOR_PARAMS.selected);
 }
 
 /* load settings from eeprom
@@ -326,6 +738,11 @@ void load_settings()
       int         full_flow.seconds
       int         pwm_mode.pulses
       long long   pwm_mode.microseconds
+      long        strobe.delay_us
+      int         strobe.drift_us
+      int         trigger.pattern
+      int         capture.seconds
+      int         injector.selected
   */
 
   int eadr = 0;
@@ -351,13 +768,43 @@ void load_settings()
   eadr += sizeof(PWM_PARAMS.pulses);
   EEPROM.get(eadr, PWM_PARAMS.microseconds);
   eadr += sizeof(PWM_PARAMS.microseconds);
+
+  /* strobe */
+  EEPROM.get(eadr, STROBE_PARAMS.delay_us);
+  eadr += sizeof(STROBE_PARAMS.delay_us);
+  EEPROM.get(eadr, STROBE_PARAMS.drift_us);
+  eadr += sizeof(STROBE_PARAMS.drift_us);
+
+  /* trigger wheel */
+  EEPROM.get(eadr, TRIGGER_PARAMS.pattern);
+  eadr += sizeof(TRIGGER_PARAMS.pattern);
+
+  /* capture mode */
+  EEPROM.get(eadr, CAPTURE_PARAMS.seconds);
+  eadr += sizeof(CAPTURE_PARAMS.seconds);
+
+  /* injector selection */
+  EEPROM.get(eadr, INJECTOR_PARAMS.selected);
+  eadr += sizeof(INJECTOR_PARAMS.selected);
+
+  /* settings saved before the strobe, trigger wheel and capture existed leave
+     these as garbage, and a saved injector may not be in the channel map any more */
+  STROBE_PARAMS.delay_us = constrain(STROBE_PARAMS.delay_us, STROBE_PARAMS.min_delay_us,
+                                     STROBE_PARAMS.max_delay_us);
+  STROBE_PARAMS.drift_us = constrain(STROBE_PARAMS.drift_us, STROBE_PARAMS.min_drift_us,
+                                     STROBE_PARAMS.max_drift_us);
+  TRIGGER_PARAMS.pattern = constrain(TRIGGER_PARAMS.pattern, TRIGGER_PARAMS.min_pattern,
+                                     TRIGGER_PARAMS.max_pattern);
+  CAPTURE_PARAMS.seconds = constrain(CAPTURE_PARAMS.seconds, CAPTURE_PARAMS.min_seconds,
+                                     CAPTURE_PARAMS.max_seconds);
+  INJECTOR_PARAMS.selected = constrain(INJECTOR_PARAMS.selected, INJECTOR_PARAMS.min_selected,
+                                       INJECTOR_PARAMS.max_selected);
 }
 
 
 /* From the LCD analog signal, figure out the button pressed */
-int get_button() 
+int button_from_adc(int x)
 {
-  int x = analogRead (0);
   if (x < 60) {
     return RIGHT;
   }
@@ -377,6 +824,64 @@ int get_button()
 }
 
 
+/* Keypad and sleep
+
+   Rather than spinning on analogRead(), the keypad is converted in the
+   background: every timer0 overflow (the millis tick, about once a
+   millisecond) starts a conversion in hardware, and the ADC interrupt keeps
+   the button it reads in keypad_button.
+
+   In between, the main code sleeps in idle mode. Any interrupt wakes it up:
+   the millis tick, a keypad conversion, a serial byte or a pulse engine edge.
+   Idle mode leaves every timer running and wakes up within a few cycles, and
+   the pins are driven from the interrupts themselves, so sleeping never
+   delays an edge. ADC noise reduction mode is no use here, it stops timer0
+   and timer1 along with the CPU. */
+
+volatile button_t keypad_button = NO_BUTTON;
+
+
+ISR(ADC_vect)
+{
+  keypad_button = (button_t)button_from_adc(ADC);
+}
+
+
+/* Start converting the keypad on A0 in the background */
+void keypad_start()
+{
+  ADMUX = _BV(REFS0);                    // AVcc reference, channel 0
+  ADCSRB = _BV(ADTS2);                   // triggered by timer0 overflow
+  ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) |
+           _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);  // clk/128
+}
+
+
+/* The button pressed, as of the last keypad conversion */
+int get_button()
+{
+  return keypad_button;
+}
+
+
+/* Sleep until the next interrupt. Callers check whatever they're waiting for
+   again after each wake up, the millis tick makes sure that's at least once
+   a millisecond */
+void idle_sleep()
+{
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+#ifdef AWAKE_PROBE
+  PORTA = PORTA & ~pin_AWAKE_MASK;
+#endif
+  sleep_cpu();
+#ifdef AWAKE_PROBE
+  PORTA = PORTA | pin_AWAKE_MASK;
+#endif
+  sleep_disable();
+}
+
+
 /* Functions to modify and bound the parameters to their specific ranges.
   FIXME: This could probably be written as one function that uses pointers to
   the variables instead.. */
@@ -452,6 +957,79 @@ void pwm_mode_change_param(int p, bool increase)
   }
 }
 
+void strobe_mode_change_param(int p, bool increase)
+{
+  int modifier = increase ? 1 : -1;
+
+  switch (p) {
+    case 0:
+      // delay after the injector opens
+      STROBE_PARAMS.delay_us += modifier * STROBE_PARAMS.delay_step;
+      STROBE_PARAMS.delay_us = STROBE_PARAMS.delay_us > STROBE_PARAMS.max_delay_us ? STROBE_PARAMS.max_delay_us : STROBE_PARAMS.delay_us;
+      STROBE_PARAMS.delay_us = STROBE_PARAMS.delay_us < STROBE_PARAMS.min_delay_us ? STROBE_PARAMS.min_delay_us : STROBE_PARAMS.delay_us;
+      break;
+      ;;
+    case 1:
+      // drift per cycle
+      STROBE_PARAMS.drift_us += modifier * STROBE_PARAMS.drift_step;
+      STROBE_PARAMS.drift_us = STROBE_PARAMS.drift_us > STROBE_PARAMS.max_drift_us ? STROBE_PARAMS.max_drift_us : STROBE_PARAMS.drift_us;
+      STROBE_PARAMS.drift_us = STROBE_PARAMS.drift_us < STROBE_PARAMS.min_drift_us ? STROBE_PARAMS.min_drift_us : STROBE_PARAMS.drift_us;
+      break;
+      ;;
+  }
+}
+
+
+void trigger_mode_change_param(int p, bool increase)
+{
+  int modifier = increase ? 1 : -1;
+
+  switch (p) {
+    case 0:
+      // pattern
+      TRIGGER_PARAMS.pattern += modifier * TRIGGER_PARAMS.pattern_step;
+      TRIGGER_PARAMS.pattern = TRIGGER_PARAMS.pattern > TRIGGER_PARAMS.max_pattern ? TRIGGER_PARAMS.max_pattern : TRIGGER_PARAMS.pattern;
+      TRIGGER_PARAMS.pattern = TRIGGER_PARAMS.pattern < TRIGGER_PARAMS.min_pattern ? TRIGGER_PARAMS.min_pattern : TRIGGER_PARAMS.pattern;
+      break;
+      ;;
+    case 1:
+      // RPM, shared with RPM mode
+      rpm_mode_change_param(1, increase);
+      break;
+      ;;
+  }
+}
+
+
+void capture_mode_change_param(int p, bool increase)
+{
+  int modifier = increase ? 1 : -1;
+
+  CAPTURE_PARAMS.seconds += modifier * CAPTURE_PARAMS.second_step;
+  CAPTURE_PARAMS.seconds = CAPTURE_PARAMS.seconds > CAPTURE_PARAMS.max_seconds ? CAPTURE_PARAMS.max_seconds : CAPTURE_PARAMS.seconds;
+  CAPTURE_PARAMS.seconds = CAPTURE_PARAMS.seconds < CAPTURE_PARAMS.min_seconds ? CAPTURE_PARAMS.min_seconds : CAPTURE_PARAMS.seconds;
+}
+
+
+void injector_mode_change_param(int p, bool increase)
+{
+  int modifier = increase ? 1 : -1;
+
+  INJECTOR_PARAMS.selected += modifier * INJECTOR_PARAMS.selected_step;
+  INJECTOR_PARAMS.selected = INJECTOR_PARAMS.selected > INJECTOR_PARAMS.max_selected ? INJECTOR_PARAMS.max_selected : INJECTOR_PARAMS.selected;
+  INJECTOR_PARAMS.selected = INJECTOR_PARAMS.selected < INJECTOR_PARAMS.min_selected ? INJECTOR_PARAMS.min_selected : INJECTOR_PARAMS.selected;
+}
+
+
+/* The port bits of the injectors the tests are to drive */
+uint8_t selected_injectors()
+{
+  if (INJECTOR_PARAMS.selected == 0) {
+    return INJECTORS::all;
+  }
+  return INJECTORS::masks[INJECTOR_PARAMS.selected - 1];
+}
+
 
 /********************************************/
 
@@ -471,16 +1049,676 @@ long calculate_injector_open_time_us(int rpm, int duty)
 }
 
 
-/* Sleep for longer than 16384 microseconds... Will blow the stack up at long delays (because no
- * tail recursion) */
-void do_longer_delay(long long microseconds) 
+/********************************************/
+
+/* Capture and replay
+
+   Captured edges are kept in a ring buffer as a stream of events. An event is
+   the state of all four channels after an edge, and the time since the event
+   before it, in units of CAPTURE_TICK_SHIFT timer1 ticks:
+
+     first byte:  bit 7 more bytes follow, bits 6-4 low bits of the delta,
+                  bits 3-0 channel states (1 = open)
+     next bytes:  bit 7 more bytes follow, bits 6-0 the next 7 bits of the delta
+
+   Two bytes hold a delta of up to about 4ms, three bytes up to about 0.5s. So
+   a closing edge usually takes two bytes and the gap to the next opening
+   three, and four sequential injectors at idle fill the buffer at around
+   130-160 bytes a second, about 30-40 seconds worth. Faster engines fill it
+   sooner. Every event holds the full channel state, so when the buffer is
+   full the oldest events can simply be dropped and replay started from
+   whatever is left. The dropped events are counted so the user knows. */
+
+/* 8 timer1 ticks, 4us. The pin change interrupt is only that accurate anyway */
+const uint8_t CAPTURE_TICK_SHIFT = 3;
+const uint16_t CAPTURE_BUFFER_SIZE = 5120;
+
+uint8_t capture_buffer[CAPTURE_BUFFER_SIZE];
+volatile uint16_t capture_head = 0;       // where the next event goes
+volatile uint16_t capture_tail = 0;       // oldest event
+volatile uint16_t capture_used = 0;       // bytes in the buffer
+volatile long capture_events = 0;         // events in the buffer
+volatile long capture_dropped = 0;        // oldest events dropped to make room
+volatile uint8_t capture_state = 0;       // channel states of the last event
+volatile uint16_t capture_overflows = 0;  // high word of the timer1 time
+volatile uint32_t capture_last = 0;       // timer1 time of the last event
+
+/* replay position, and the event the pulse engine outputs next */
+volatile uint16_t replay_read = 0;
+volatile long replay_events_left = 0;
+volatile uint8_t replay_bits = 0;         // injector port bits of the event
+
+
+/* Number of events captured */
+long capture_event_count()
+{
+  noInterrupts();
+  long count = capture_events;
+  interrupts();
+  return count;
+}
+
+
+/* Number of events dropped because the buffer was full */
+long capture_dropped_count()
+{
+  noInterrupts();
+  long count = capture_dropped;
+  interrupts();
+  return count;
+}
+
+
+static inline void capture_advance(volatile uint16_t *pos)
+{
+  if (++*pos == CAPTURE_BUFFER_SIZE) {
+    *pos = 0;
+  }
+}
+
+
+/* Add an event to the ring buffer, dropping the oldest events to make room */
+static inline void capture_put(uint8_t state, uint32_t delta)
 {
-  if (microseconds > 16383) {
-    delayMicroseconds(16383);
-    do_longer_delay(microseconds - 16383);
+  uint8_t bytes[5];
+  uint8_t len = 0;
+
+  bytes[len] = state | ((delta & 0x07) << 4);
+  delta >>= 3;
+  while (delta) {
+    bytes[len++] |= 0x80;
+    bytes[len] = delta & 0x7f;
+    delta >>= 7;
+  }
+  len++;
+
+  while (CAPTURE_BUFFER_SIZE - capture_used < len) {
+    uint8_t b;
+    do {
+      b = capture_buffer[capture_tail];
+      capture_advance(&capture_tail);
+      capture_used--;
+    } while (b & 0x80);
+    capture_events--;
+    capture_dropped++;
+  }
+
+  for (uint8_t i = 0; i < len; i++) {
+    capture_buffer[capture_head] = bytes[i];
+    capture_advance(&capture_head);
+  }
+  capture_used += len;
+  capture_events++;
+}
+
+
+/* Read the event at replay_read and move on past it. Returns the delta and
+   puts the injector bits for the event in replay_bits */
+static inline uint32_t replay_get()
+{
+  uint8_t b = capture_buffer[replay_read];
+  capture_advance(&replay_read);
+
+  uint8_t bits = 0;
+  for (uint8_t c = 0; c < CAPTURE_CHANNELS && c < INJECTORS::count; c++) {
+    if (b & _BV(c)) {
+      bits |= INJECTORS::masks[c];
+    }
+  }
+  replay_bits = bits;
+
+  uint32_t delta = (b >> 4) & 0x07;
+  uint8_t shift = 3;
+  while (b & 0x80) {
+    b = capture_buffer[replay_read];
+    capture_advance(&replay_read);
+    delta |= (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+  }
+  return delta;
+}
+
+
+ISR(TIMER1_OVF_vect)
+{
+  capture_overflows++;
+}
+
+
+ISR(PCINT2_vect)
+{
+  uint16_t low = TCNT1;
+  uint16_t high = capture_overflows;
+  if ((TIFR1 & _BV(TOV1)) && low < 0x8000) {
+    /* timer wrapped after this interrupt started, count it here */
+    high++;
+  }
+  uint32_t now = ((uint32_t)high << 16) | low;
+
+  /* inputs are pulled low while the injector is open */
+  uint8_t state = ~PINK & pin_CAPTURE_MASK;
+  if (state == capture_state) {
+    return;
+  }
+  capture_state = state;
+
+  /* step capture_last in whole units, so rounding never adds up */
+  uint32_t delta = (now - capture_last) >> CAPTURE_TICK_SHIFT;
+  capture_last += delta << CAPTURE_TICK_SHIFT;
+  if (capture_events == 0) {
+    delta = 0;
+  }
+  capture_put(state, delta);
+}
+
+
+/* Empty the buffer and start capturing edges on the input pins */
+void capture_start()
+{
+  DDRK = DDRK & ~pin_CAPTURE_MASK;
+  PORTK = PORTK | pin_CAPTURE_MASK;  // pull-ups
+
+  noInterrupts();
+  capture_head = 0;
+  capture_tail = 0;
+  capture_used = 0;
+  capture_events = 0;
+  capture_dropped = 0;
+  capture_state = 0;
+  capture_overflows = 0;
+  capture_last = 0;
+  TIFR1 = _BV(TOV1);
+  TIMSK1 = TIMSK1 | _BV(TOIE1);
+  PCMSK2 = pin_CAPTURE_MASK;
+  PCIFR = _BV(PCIF2);
+  PCICR = PCICR | _BV(PCIE2);
+  interrupts();
+}
+
+
+void capture_stop()
+{
+  noInterrupts();
+  PCICR = PCICR & ~_BV(PCIE2);
+  PCMSK2 = 0;
+  TIMSK1 = TIMSK1 & ~_BV(TOIE1);
+  interrupts();
+}
+
+
+/********************************************/
+
+/* Pulse engine
+
+   The injector edges are generated from the timer1 compare A interrupt, the
+   strobe from the compare B output pin and the crank trigger wheel from the
+   compare C output pin, so all of them run off the same timebase. Captured
+   injector signals are replayed by the compare A interrupt too.
+
+   Timer1 free-runs at half a microsecond per tick and wraps every 32.7ms, so
+   longer intervals are waited out in chunks: the compare register is moved on
+   a chunk at a time and only the last compare of an interval touches the pins.
+   Every compare value is relative to the previous one rather than to TCNT1,
+   so the schedule never drifts, however late an interrupt gets serviced.
+
+   The timing of a running engine is changed by filling in ENGINE_PENDING. The
+   compare A interrupt swaps it in as it opens the injectors for a new cycle,
+   so a pulse is never cut short or given twice, and the strobe and trigger
+   wheel change over on the same 720 degree boundary. */
+
+typedef struct {
+  uint32_t open_ticks;        // how long the injectors stay open
+  uint32_t cycle_ticks;       // time from one opening to the next
+  uint32_t strobe_start;      // first strobe delay after an opening
+  uint32_t strobe_period;     // strobe delay starts over once it gets here
+  uint16_t wheel_step_ticks;  // trigger wheel half tooth
+  uint16_t wheel_step_rem;    // cycle ticks left over by wheel_step_ticks
+} pulse_timing;
+
+/* only ever touched with interrupts off, or from the timer1 interrupts */
+pulse_timing ENGINE_TIMING;
+pulse_timing ENGINE_PENDING;
+volatile bool engine_pending = false;     // ENGINE_PENDING is waiting to be swapped in
+volatile uint8_t engine_mask = 0;         // injector port bits being pulsed
+volatile bool engine_running = false;
+volatile bool engine_open = false;        // injectors currently open
+volatile long engine_pulses_left = -1;    // -1 pulses until stopped
+volatile long engine_pulse_count = 0;     // openings since the engine started
+volatile uint32_t engine_wait = 0;        // ticks left before the next edge
+volatile bool engine_replay = false;      // replaying captured events instead
+
+/* The strobe fires strobe_phase ticks after each opening. The phase moves on
+   by strobe_drift every cycle, and starts over from the timing's strobe_start
+   once it reaches strobe_period */
+volatile uint32_t strobe_phase = 0;
+volatile uint32_t strobe_drift = 0;
+volatile uint32_t strobe_wait = 0;        // ticks left before the flash
+
+/* The trigger wheel is a precomputed table of edges over one 720 degree cycle.
+   Edge positions are counted in steps of half a tooth, and each entry holds the
+   number of steps to the next edge. Steps are turned into ticks as the wheel
+   runs, carrying the remainder along so that a whole table adds up to exactly
+   one injector cycle */
+const uint8_t WHEEL_CRANK = 1;
+const uint8_t WHEEL_CAM = 2;
+
+typedef struct {
+  uint8_t steps;    // steps from this edge to the next
+  uint8_t level;    // WHEEL_CRANK / WHEEL_CAM levels after this edge
+} trigger_edge;
+
+/* Two edges per tooth over two revolutions. Edge positions are kept in
+   uint8_t steps, so a whole cycle of 4 * teeth steps has to fit in one */
+const uint8_t MAX_WHEEL_TEETH = 60;
+static_assert(4 * MAX_WHEEL_TEETH <= 255, "wheel positions have to fit in a uint8_t");
+
+trigger_edge wheel_edges[2 * 2 * MAX_WHEEL_TEETH];
+volatile uint8_t wheel_edge_count = 0;    // 0 when no wheel is to be output
+volatile uint8_t wheel_edge = 0;          // edge being waited for
+volatile uint16_t wheel_total_steps = 0;  // steps per 720 degrees
+volatile uint16_t wheel_error = 0;
+volatile uint32_t wheel_wait = 0;         // ticks left before the next edge
+
+
+/* Set timer1 up as the free-running pulse engine timebase */
+void timer1_setup()
+{
+  /* normal mode at clk/8. OC1B and OC1C are left in clear-on-compare mode
+     and forced low, so the strobe and crank outputs start out low */
+  TCCR1A = _BV(COM1B1) | _BV(COM1C1);
+  TCCR1B = _BV(CS11);
+  TCCR1C = _BV(FOC1B) | _BV(FOC1C);
+  TIMSK1 = 0;
+
+  PORTB = PORTB & ~pin_CAM_MASK;
+  DDRB = DDRB | pin_STROBE_MASK | pin_CRANK_MASK | pin_CAM_MASK;
+}
+
+
+/* Take the next chunk off an interval being waited out on timer1. The split
+   never leaves a remainder so short that the compare could be missed */
+static inline uint16_t timer1_next_chunk(volatile uint32_t *ticks)
+{
+  uint16_t chunk = *ticks > 0xC000 ? 0x8000 : (uint16_t)*ticks;
+  *ticks -= chunk;
+  return chunk;
+}
+
+
+/* A replayed event due less than this after the counter was read is not
+   given a compare, the interrupt waits for it instead. Entering the interrupt
+   and decoding the event have already been paid for by then, so this only
+   needs to cover the few instructions between reading TCNT1 and writing
+   OCR1A. Set too low, the compare lands behind the counter and the event
+   comes out a whole timer wrap (32.768 ms) late */
+const int16_t REPLAY_MARGIN_TICKS = 10 * TICKS_PER_US;
+
+
+/* Schedule the strobe relative to the compare that just opened the injectors */
+static inline void strobe_arm(uint16_t opened_at)
+{
+  /* checked against the timing in use now, which may have just been swapped
+     in with a shorter period than the phase was last checked against */
+  if (strobe_phase >= ENGINE_TIMING.strobe_period) {
+    strobe_phase = ENGINE_TIMING.strobe_start;
+  }
+  strobe_wait = strobe_phase;
+  strobe_phase += strobe_drift;
+
+  OCR1B = opened_at + timer1_next_chunk(&strobe_wait);
+  if (strobe_wait) {
+    TCCR1A = TCCR1A & ~_BV(COM1B0);  // still waiting, keep the pin low
+  } else {
+    TCCR1A = TCCR1A | _BV(COM1B0);   // raise the pin on this compare
+  }
+  TIFR1 = _BV(OCF1B);
+  TIMSK1 = TIMSK1 | _BV(OCIE1B);
+}
+
+
+ISR(TIMER1_COMPA_vect)
+{
+  if (engine_wait) {
+    OCR1A += timer1_next_chunk(&engine_wait);
+    return;
+  }
+
+  if (engine_replay) {
+    uint16_t due = OCR1A;
+    for (;;) {
+      INJECTORS::port() = (INJECTORS::port() & ~engine_mask) | replay_bits;
+      engine_pulse_count++;
+      if (--replay_events_left == 0) {
+        TIMSK1 = TIMSK1 & ~_BV(OCIE1A);
+        engine_running = false;
+        return;
+      }
+      engine_wait = replay_get() << CAPTURE_TICK_SHIFT;
+      if (engine_wait >= 0x8000 ||
+          (int16_t)(due + (uint16_t)engine_wait - TCNT1) >= REPLAY_MARGIN_TICKS) {
+        break;
+      }
+      /* too close to catch with a compare, wait for it here */
+      due += (uint16_t)engine_wait;
+      engine_wait = 0;
+      while ((int16_t)(TCNT1 - due) < 0) {
+      }
+    }
+    OCR1A = due;
+  } else if (! engine_open) {
+    /* start of a cycle, and the only place the timing may change */
+    INJECTORS::port() = INJECTORS::port() | engine_mask;
+    engine_open = true;
+    engine_pulse_count++;
+    if (engine_pending) {
+      ENGINE_TIMING = ENGINE_PENDING;
+      engine_pending = false;
+    }
+    strobe_arm(OCR1A);
+    engine_wait = ENGINE_TIMING.open_ticks;
+  } else {
+    INJECTORS::port() = INJECTORS::port() & ~engine_mask;
+    engine_open = false;
+    if (engine_pulses_left > 0 && --engine_pulses_left == 0) {
+      TIMSK1 = TIMSK1 & ~_BV(OCIE1A);
+      engine_running = false;
+      return;
+    }
+    engine_wait = ENGINE_TIMING.cycle_ticks - ENGINE_TIMING.open_ticks;
+  }
+  OCR1A += timer1_next_chunk(&engine_wait);
+}
+
+
+ISR(TIMER1_COMPB_vect)
+{
+  if (strobe_wait) {
+    OCR1B += timer1_next_chunk(&strobe_wait);
+    if (! strobe_wait) {
+      TCCR1A = TCCR1A | _BV(COM1B0);
+    }
+    return;
+  }
+
+  if (TCCR1A & _BV(COM1B0)) {
+    /* the hardware has just raised the pin, drop it again after the pulse */
+    TCCR1A = TCCR1A & ~_BV(COM1B0);
+    OCR1B += STROBE_PULSE_US * TICKS_PER_US;
+  } else {
+    TIMSK1 = TIMSK1 & ~_BV(OCIE1B);
+  }
+}
+
+
+/* Make OC1C drive the crank output high or low on the next compare */
+static inline void wheel_crank_mode(uint8_t level)
+{
+  if (level & WHEEL_CRANK) {
+    TCCR1A = TCCR1A | _BV(COM1C0);
+  } else {
+    TCCR1A = TCCR1A & ~_BV(COM1C0);
+  }
+}
+
+
+ISR(TIMER1_COMPC_vect)
+{
+  if (wheel_wait) {
+    OCR1C += timer1_next_chunk(&wheel_wait);
+    if (! wheel_wait) {
+      wheel_crank_mode(wheel_edges[wheel_edge].level);
+    }
+    return;
+  }
+
+  /* the hardware has just output the crank edge, the cam follows it */
+  uint8_t level = wheel_edges[wheel_edge].level;
+  if (level & WHEEL_CAM) {
+    PORTB = PORTB | pin_CAM_MASK;
+  } else {
+    PORTB = PORTB & ~pin_CAM_MASK;
+  }
+
+  uint8_t steps = wheel_edges[wheel_edge].steps;
+  wheel_wait = (uint32_t)steps * ENGINE_TIMING.wheel_step_ticks;
+  wheel_error += steps * ENGINE_TIMING.wheel_step_rem;
+  while (wheel_error >= wheel_total_steps) {
+    wheel_error -= wheel_total_steps;
+    wheel_wait++;
+  }
+
+  wheel_edge++;
+  if (wheel_edge == wheel_edge_count) {
+    wheel_edge = 0;
+  }
+
+  OCR1C += timer1_next_chunk(&wheel_wait);
+
+  /* until the last chunk, compares leave the pin where it is */
+  wheel_crank_mode(wheel_wait ? level : wheel_edges[wheel_edge].level);
+}
+
+
+/* Fill in the edge table for a trigger wheel pattern. The wheel is output
+   alongside the injector pulses by the next pulse_engine_start(). Returns
+   false, and leaves no wheel to output, if the pattern doesn't fit */
+bool trigger_wheel_build(const trigger_pattern *pattern)
+{
+  uint8_t n = 0;
+
+  if (pattern->teeth > MAX_WHEEL_TEETH || pattern->missing >= pattern->teeth) {
+    wheel_edge_count = 0;
+    return false;
+  }
+
+  /* first the position of every edge, tooth 0 rising with the first opening */
+  for (uint8_t t = 0; t < 2 * pattern->teeth; t++) {
+    if (t % pattern->teeth >= pattern->teeth - pattern->missing) {
+      continue;
+    }
+    uint8_t cam = (t >= pattern->cam_tooth &&
+                   t < pattern->cam_tooth + pattern->cam_width) ? WHEEL_CAM : 0;
+
+    wheel_edges[n].steps = 2 * t;
+    wheel_edges[n].level = WHEEL_CRANK | cam;
+    n++;
+    wheel_edges[n].steps = 2 * t + 1;
+    wheel_edges[n].level = cam;
+    n++;
+  }
+
+  /* then turn the positions into steps to the next edge */
+  for (uint8_t e = 0; e < n - 1; e++) {
+    wheel_edges[e].steps = wheel_edges[e + 1].steps - wheel_edges[e].steps;
+  }
+  wheel_edges[n - 1].steps = 4 * pattern->teeth - wheel_edges[n - 1].steps;
+
+  wheel_total_steps = 4 * pattern->teeth;
+  wheel_edge_count = n;
+  return true;
+}
+
+
+/* Work out the timing block for injectors open for open_ticks out of every cycle_ticks */
+void pulse_timing_compute(pulse_timing *timing, uint32_t open_ticks, uint32_t cycle_ticks)
+{
+  timing->open_ticks = open_ticks;
+  timing->cycle_ticks = cycle_ticks;
+
+  /* the flash has to be over before the next opening re-arms it */
+  uint32_t period = cycle_ticks - 2 * STROBE_PULSE_US * TICKS_PER_US;
+  uint32_t start = STROBE_PARAMS.delay_us * TICKS_PER_US;
+  while (start >= period) {
+    start -= period;
+  }
+  if (start < (uint32_t)(STROBE_PARAMS.min_delay_us * TICKS_PER_US)) {
+    start = STROBE_PARAMS.min_delay_us * TICKS_PER_US;
+  }
+  timing->strobe_start = start;
+  timing->strobe_period = period;
+
+  timing->wheel_step_ticks = 0;
+  timing->wheel_step_rem = 0;
+  if (wheel_edge_count) {
+    timing->wheel_step_ticks = cycle_ticks / wheel_total_steps;
+    timing->wheel_step_rem = cycle_ticks % wheel_total_steps;
+  }
+}
+
+
+/* Start pulsing the injectors in mask, open for open_ticks out of every cycle_ticks.
+   pulses is the number of pulses to give, or -1 to keep going until stopped */
+void pulse_engine_start(uint32_t open_ticks, uint32_t cycle_ticks, uint8_t mask, long pulses)
+{
+  pulse_timing timing;
+  pulse_timing_compute(&timing, open_ticks, cycle_ticks);
+
+  noInterrupts();
+  ENGINE_TIMING = timing;
+  engine_pending = false;
+  engine_replay = false;
+  engine_mask = mask;
+  engine_open = false;
+  engine_pulses_left = pulses;
+  engine_pulse_count = 0;
+  engine_wait = 0;
+
+  strobe_phase = timing.strobe_start;
+  strobe_drift = STROBE_PARAMS.drift_us * TICKS_PER_US;
+
+  /* first opening 100us from now */
+  engine_running = true;
+  OCR1A = TCNT1 + 100 * TICKS_PER_US;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 = TIMSK1 | _BV(OCIE1A);
+
+  /* the first crank edge goes out together with the first opening */
+  if (wheel_edge_count) {
+    wheel_error = 0;
+    wheel_edge = 0;
+    wheel_wait = 0;
+    OCR1C = OCR1A;
+    wheel_crank_mode(wheel_edges[0].level);
+    TIFR1 = _BV(OCF1C);
+    TIMSK1 = TIMSK1 | _BV(OCIE1C);
+  }
+  interrupts();
+}
+
+
+/* Change the timing of the running engine. It takes over at the start of the
+   next cycle, a later call before then replaces it */
+void pulse_engine_retime(uint32_t open_ticks, uint32_t cycle_ticks)
+{
+  pulse_timing timing;
+  pulse_timing_compute(&timing, open_ticks, cycle_ticks);
+
+  noInterrupts();
+  ENGINE_PENDING = timing;
+  engine_pending = true;
+  interrupts();
+}
+
+
+/* Drive the injectors with the captured events, with the same timing they were
+   captured with */
+void pulse_engine_replay()
+{
+  noInterrupts();
+  if (capture_events == 0) {
+    interrupts();
+    return;
+  }
+  engine_replay = true;
+  engine_mask = INJECTORS::all;
+  engine_open = false;
+  engine_pulse_count = 0;
+  engine_wait = 0;
+
+  /* the oldest event has nothing before it, its delta is meaningless */
+  replay_read = capture_tail;
+  replay_events_left = capture_events;
+  replay_get();
+
+  /* first event 100us from now */
+  engine_running = true;
+  OCR1A = TCNT1 + 100 * TICKS_PER_US;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 = TIMSK1 | _BV(OCIE1A);
+  interrupts();
+}
+
+
+/* Stop pulsing. An injector pulse in progress is allowed to finish, so the
+   last pulse is never cut short */
+void pulse_engine_stop()
+{
+  noInterrupts();
+  if (engine_open) {
+    engine_pulses_left = 1;
   } else {
-    delayMicroseconds(microseconds);
+    TIMSK1 = TIMSK1 & ~_BV(OCIE1A);
+    engine_running = false;
+  }
+  interrupts();
+
+  while (engine_running) {
+    idle_sleep();
   }
+
+  /* let the flash for the last pulse finish, the strobe interrupt disables
+     itself once the pin has dropped again */
+  while (TIMSK1 & _BV(OCIE1B)) {
+    idle_sleep();
+  }
+
+  /* and make sure the strobe is dark and the trigger wheel is stopped */
+  noInterrupts();
+  TIMSK1 = TIMSK1 & ~(_BV(OCIE1B) | _BV(OCIE1C));
+  TCCR1A = TCCR1A & ~(_BV(COM1B0) | _BV(COM1C0));
+  TCCR1C = _BV(FOC1B) | _BV(FOC1C);
+  PORTB = PORTB & ~pin_CAM_MASK;
+  wheel_edge_count = 0;
+
+  /* a replay can be stopped with injectors open */
+  INJECTORS::port() = INJECTORS::port() & ~engine_mask;
+  engine_replay = false;
+  interrupts();
+}
+
+
+/* Number of injector openings since the engine was started */
+long pulse_engine_pulse_count()
+{
+  noInterrupts();
+  long count = engine_pulse_count;
+  interrupts();
+  return count;
+}
+
+
+/* Show the injector pulse width, and the rpm and duty that can be changed while
+   RPM mode runs. param is the one UP / DOWN changes, 1 for rpm and 2 for duty */
+void show_rpm_run_status(long injector_open_time, int param)
+{
+  char buf[24];
+  char *p = fmt_str(buf, "IPW: ");
+  p = fmt_fixed(p, injector_open_time, 3, 2);
+  p = fmt_str(p, "ms");
+  fmt_line(buf, p, 16);
+  lcd.setCursor(0,0);
+  lcd.print(buf);
+
+  // example: ">1000rpm  50%"
+  p = fmt_str(buf, param == 1 ? ">" : " ");
+  p = fmt_int(p, RPM_MODE_PARAMS.rpm);
+  p = fmt_str(p, "rpm ");
+  p = fmt_str(p, param == 2 ? ">" : " ");
+  p = fmt_int(p, RPM_MODE_PARAMS.duty);
+  p = fmt_str(p, "%");
+  fmt_line(buf, p, 16);
+  lcd.setCursor(0,1);
+  lcd.print(buf);
 }
 
 
@@ -495,17 +1733,30 @@ void do_constant_rpm_mode()
   long injector_close_time = cycle_720_time - injector_open_time;
 
   char buf[100];
-
-  snprintf(buf, sizeof(buf), "cycle_720_time: %ld,  open_time = %ld,  close_time = %ld, "
-          "rpm = %d,   duty = %d", cycle_720_time, injector_open_time, injector_close_time, rpm, duty);
+  char *p;
+
+  p = fmt_str(buf, "cycle_720_time: ");
+  p = fmt_int(p, cycle_720_time);
+  p = fmt_str(p, ",  open_time = ");
+  p = fmt_int(p, injector_open_time);
+  p = fmt_str(p, ",  close_time = ");
+  p = fmt_int(p, injector_close_time);
+  p = fmt_str(p, ", rpm = ");
+  p = fmt_int(p, rpm);
+  p = fmt_str(p, ",   duty = ");
+  p = fmt_int(p, duty);
+  fmt_end(p);
   Serial.println(buf);
 
-  snprintf(buf, sizeof(buf), "IPW: %ld.%ldms        ", injector_open_time / 1000L, (long)(injector_open_time % 1000L));
+  p = fmt_str(buf, "IPW: ");
+  p = fmt_fixed(p, injector_open_time, 3, 3);
+  p = fmt_str(p, "ms");
+  fmt_end(p);
   Serial.println(buf);
 
-  snprintf(buf, 17, "IPW: %ld.%ldms        ", injector_open_time / 1000L, (long)(injector_open_time % 1000L));
-  lcd.setCursor(0,0);
-  lcd.print(buf);
+  /* UP / DOWN change the rpm to start with, LEFT switches to the duty */
+  int param = 1;
+  show_rpm_run_status(injector_open_time, param);
 
   /* Turn on fuel pump */
   digitalWrite(pin_FUEL_PUMP_RELAY, LOW);
@@ -515,22 +1766,94 @@ void do_constant_rpm_mode()
   long start_time = micros();
   long end_time = start_time + (long)(seconds * 1000000L);
 
-  snprintf(buf, sizeof(buf), "start time: %ld,   end_time = %ld", start_time, end_time);
+  p = fmt_str(buf, "start time: ");
+  p = fmt_int(p, start_time);
+  p = fmt_str(p, ",   end_time = ");
+  p = fmt_int(p, end_time);
+  fmt_end(p);
   Serial.println(buf);
 
   Serial.println("waiting");
-  /* Do the actual injector pulsing */ 
-  uint8_t pin_ALL_INJECTORS_MASK = pin_INJECTOR_1_MASK | pin_INJECTOR_2_MASK | 
-                                   pin_INJECTOR_3_MASK | pin_INJECTOR_4_MASK;
-  do {
-    /* turn on */
-    PORTB = PORTB | pin_ALL_INJECTORS_MASK;
-    do_longer_delay(injector_open_time);
-
-    /* turn off */
-    PORTB = PORTB & (~pin_ALL_INJECTORS_MASK);
-    do_longer_delay(injector_close_time);
-  } while (end_time > micros()); // FIXME: What if end_time overflowed? This will run for a long time then...
+  /* Do the actual injector pulsing. The pulse engine does it in the background,
+     while we wait for the time to run out and let the user change the rpm and
+     duty: UP / DOWN, or R / r and D / d on the serial port */
+  pulse_engine_start(injector_open_time * TICKS_PER_US, cycle_720_time * TICKS_PER_US,
+                     selected_injectors(), -1);
+
+  button_t held = (button_t)get_button();  // the RIGHT that started us
+  unsigned long held_since = micros();
+  while (end_time > micros()) { // FIXME: What if end_time overflowed? This will run for a long time then...
+    int change = 0;  // which parameter to change, as in rpm_mode_change_param()
+    bool increase = false;
+
+    button_t button = (button_t)get_button();
+    unsigned long now = micros();
+    bool repeat = (button == UP || button == DOWN) && (now - held_since) > 300000;
+    if (button != held || repeat) {
+      held = button;
+      held_since = now;
+
+      if (button == LEFT) {
+        param = param == 1 ? 2 : 1;
+        show_rpm_run_status(injector_open_time, param);
+      }
+      else if (button == UP || button == DOWN) {
+        change = param;
+        increase = button == UP;
+      }
+    }
+
+    if (Serial.available()) {
+      switch (Serial.read()) {
+        case 'R':
+          change = 1;
+          increase = true;
+          break;
+          ;;
+        case 'r':
+          change = 1;
+          increase = false;
+          break;
+          ;;
+        case 'D':
+          change = 2;
+          increase = true;
+          break;
+          ;;
+        case 'd':
+          change = 2;
+          increase = false;
+          break;
+          ;;
+      }
+    }
+
+    if (change) {
+      rpm_mode_change_param(change, increase);
+      rpm = RPM_MODE_PARAMS.rpm;
+      duty = RPM_MODE_PARAMS.duty;
+      cycle_720_time = calculate_720_time_us(rpm);
+      injector_open_time = calculate_injector_open_time_us(rpm, duty);
+
+      /* takes over at the next 720 degree boundary */
+      pulse_engine_retime(injector_open_time * TICKS_PER_US, cycle_720_time * TICKS_PER_US);
+
+      show_rpm_run_status(injector_open_time, param);
+
+      p = fmt_str(buf, "rpm = ");
+      p = fmt_int(p, rpm);
+      p = fmt_str(p, ",   duty = ");
+      p = fmt_int(p, duty);
+      p = fmt_str(p, ",   IPW: ");
+      p = fmt_fixed(p, injector_open_time, 3, 3);
+      p = fmt_str(p, "ms");
+      fmt_end(p);
+      Serial.println(buf);
+    }
+
+    idle_sleep();
+  }
+  pulse_engine_stop();
   Serial.println("done");
 
   /* Turn off fuel pump */
@@ -538,13 +1861,155 @@ void do_constant_rpm_mode()
 }
 
 
+/* In trigger wheel mode, we run RPM mode with the crank and cam signals of the
+   selected trigger wheel on top */
+void do_trigger_wheel_mode()
+{
+  const trigger_pattern *pattern = &TRIGGER_PATTERNS[TRIGGER_PARAMS.pattern];
+
+  char buf[100];
+  char *p = fmt_str(buf, "Trigger wheel mode: ");
+  p = fmt_str(p, pattern->name);
+  p = fmt_str(p, " wheel at ");
+  p = fmt_int(p, RPM_MODE_PARAMS.rpm);
+  p = fmt_str(p, " rpm");
+  fmt_end(p);
+  Serial.println(buf);
+
+  if (! trigger_wheel_build(pattern)) {
+    Serial.println("Trigger wheel mode: pattern doesn't fit the edge table");
+    return;
+  }
+  do_constant_rpm_mode();
+}
+
+
+/* In capture mode, we record the injector signals on the capture inputs until
+   the time runs out or a button is pressed */
+void do_capture_mode()
+{
+  int seconds = CAPTURE_PARAMS.seconds;
+
+  char buf[100];
+  char *p = fmt_str(buf, "Capture mode: capturing for up to ");
+  p = fmt_int(p, seconds);
+  p = fmt_str(p, " seconds");
+  fmt_end(p);
+  Serial.println(buf);
+
+  lcd.setCursor(0,0);
+  lcd.print("Capturing...    ");
+
+  /* wait for the button that started us to be let go */
+  while (get_button() != NO_BUTTON) {
+    idle_sleep();
+  }
+
+  // FIXME: Handle overflowing end_time
+  long start_time = micros();
+  long end_time = start_time + (long)(seconds * 1000000L);
+
+  /* update the display five times a second */
+  capture_start();
+  unsigned long shown_at = millis() - 200;
+  do {
+    if (millis() - shown_at >= 200) {
+      shown_at = millis();
+
+      p = fmt_int(buf, capture_event_count());
+      p = fmt_str(p, " edges ");
+      p = fmt_int(p, (end_time - (long)micros())/1000000L);
+      p = fmt_str(p, "s");
+      fmt_line(buf, p, 16);
+
+      lcd.setCursor(0,1);
+      lcd.print(buf);
+
+      /* the buffer is full and the oldest edges are going */
+      long dropped = capture_dropped_count();
+      if (dropped) {
+        p = fmt_str(buf, "Full, lost ");
+        p = fmt_int(p, dropped);
+        fmt_line(buf, p, 16);
+
+        lcd.setCursor(0,0);
+        lcd.print(buf);
+      }
+    }
+    idle_sleep();
+  } while (end_time > micros() && get_button() == NO_BUTTON);
+  capture_stop();
+
+  /* and for the button that stopped us, so it isn't taken as a menu press */
+  while (get_button() != NO_BUTTON) {
+    idle_sleep();
+  }
+
+  p = fmt_str(buf, "Capture mode: ");
+  p = fmt_int(p, capture_event_count());
+  p = fmt_str(p, " edges in ");
+  p = fmt_uint(p, capture_used);
+  p = fmt_str(p, " bytes, ");
+  p = fmt_int(p, capture_dropped_count());
+  p = fmt_str(p, " oldest dropped");
+  fmt_end(p);
+  Serial.println(buf);
+}
+
+
+/* In replay mode, we run the pump and drive the injectors with what was captured */
+void do_replay_mode()
+{
+  long events = capture_event_count();
+
+  char buf[100];
+  char *p = fmt_str(buf, "Replay mode: replaying ");
+  p = fmt_int(p, events);
+  p = fmt_str(p, " edges");
+  fmt_end(p);
+  Serial.println(buf);
+
+  if (events == 0) {
+    return;
+  }
+
+  /* Turn on fuel pump */
+  digitalWrite(pin_FUEL_PUMP_RELAY, LOW);
+  delay(2000); // wait for 2s for stuff to stabilize
+
+  pulse_engine_replay();
+
+  long shown = -1;
+  while (engine_running) {
+    long done = pulse_engine_pulse_count();
+    if (done / 100 != shown) {
+      shown = done / 100;
+
+      p = fmt_str(buf, "edges left ");
+      p = fmt_int(p, events - done);
+      fmt_line(buf, p, 16);
+      lcd.setCursor(0, 0);
+      lcd.print(buf);
+    }
+    idle_sleep();
+  }
+  pulse_engine_stop();
+
+  /* Turn off fuel pump */
+  digitalWrite(pin_FUEL_PUMP_RELAY, HIGH);
+}
+
+
 /* In Leak test mode, we simply run the fuel pump for n seconds */
 void do_leak_test_mode()
 {
   int seconds = LEAK_TEST_PARAMS.seconds;
 
   char buf[100];
-  snprintf(buf, sizeof(buf), "Leak test mode: Running pump for %d seconds", seconds);
+  char *p = fmt_str(buf, "Leak test mode: Running pump for ");
+  p = fmt_int(p, seconds);
+  p = fmt_str(p, " seconds");
+  fmt_end(p);
   Serial.println(buf);
 
   /* Record start and end-times. Should probably check for overflow in the end_time variable
@@ -557,11 +2022,20 @@ void do_leak_test_mode()
   digitalWrite(pin_FUEL_PUMP_RELAY, LOW);
 
   /* Now wait, and update the display every second */
+  long shown = -1;
   do {
-    snprintf(buf, sizeof(buf), "%ds left               ", (end_time - micros())/1000000L);
+    long left = (end_time - (long)micros())/1000000L;
+    if (left != shown) {
+      shown = left;
 
-    lcd.setCursor(0,1);
-    lcd.print(buf);
+      p = fmt_int(buf, left);
+      p = fmt_str(p, "s left");
+      fmt_line(buf, p, 16);
+
+      lcd.setCursor(0,1);
+      lcd.print(buf);
+    }
+    idle_sleep();
   } while (end_time > micros());
 
   /* Turn off fuel pump */
@@ -575,7 +2049,10 @@ void do_full_flow_mode()
   int seconds = FULL_FLOW_PARAMS.seconds;
 
   char buf[100];
-  snprintf(buf, sizeof(buf), "Full flow mode: full flow for %d seconds", seconds);
+  char *p = fmt_str(buf, "Full flow mode: full flow for ");
+  p = fmt_int(p, seconds);
+  p = fmt_str(p, " seconds");
+  fmt_end(p);
   Serial.println(buf);
 
   /* Turn on fuel pump */
@@ -589,21 +2066,29 @@ void do_full_flow_mode()
   long end_time = start_time + (long)(seconds * 1000000L);
 
   /* Turn on injectors */
-  uint8_t pin_ALL_INJECTORS_MASK = pin_INJECTOR_1_MASK | pin_INJECTOR_2_MASK | 
-                                   pin_INJECTOR_3_MASK | pin_INJECTOR_4_MASK;
-  PORTB = PORTB | pin_ALL_INJECTORS_MASK;
+  uint8_t injectors = selected_injectors();
+  INJECTORS::port() = INJECTORS::port() | injectors;
 
   /* Now wait, and update the display every second */
+  long shown = -1;
   do {
-    snprintf(buf, sizeof(buf), "%ds left               ", (end_time - micros())/1000000L);
+    long left = (end_time - (long)micros())/1000000L;
+    if (left != shown) {
+      shown = left;
 
-    lcd.setCursor(0,1);
-    lcd.print(buf);
+      p = fmt_int(buf, left);
+      p = fmt_str(p, "s left");
+      fmt_line(buf, p, 16);
+
+      lcd.setCursor(0,1);
+      lcd.print(buf);
+    }
+    idle_sleep();
   } while (end_time > micros());
 
   /* Turn off fuel pump and injectors */
   digitalWrite(pin_FUEL_PUMP_RELAY, HIGH);
-  PORTB = PORTB & (~pin_ALL_INJECTORS_MASK);
+  INJECTORS::port() = INJECTORS::port() & (~injectors);
 }
 
 void do_pwm_mode()
@@ -612,7 +2097,11 @@ void do_pwm_mode()
   long pulses = PWM_PARAMS.pulses;
 
   char buf[100];
-  snprintf(buf, sizeof(buf), "PWM mode:  pulsewidth = %ld us,  number of pulses %d", pulsewidth, pulses);
+  char *p = fmt_str(buf, "PWM mode:  pulsewidth = ");
+  p = fmt_int(p, (long)pulsewidth);
+  p = fmt_str(p, " us,  number of pulses ");
+  p = fmt_int(p, pulses);
+  fmt_end(p);
   Serial.println(buf);
 
   /* Turn on fuel pump */
@@ -622,27 +2111,28 @@ void do_pwm_mode()
   Serial.println("after fuel pump");
 
   /* Do the actual injector pulsing */ 
-  uint8_t pin_ALL_INJECTORS_MASK = pin_INJECTOR_1_MASK | pin_INJECTOR_2_MASK | 
-                                   pin_INJECTOR_3_MASK | pin_INJECTOR_4_MASK;
-  /* pulse injectors */
-  for (int p = 0; p < pulses; p++) {
-
-    /* idea is:  turn injector on, sleep for some time, turn off. Then delay some time until starting again */
-
-    /* turn on */
-    PORTB = PORTB | pin_ALL_INJECTORS_MASK;
-    delayMicroseconds(pulsewidth);
-
-    /* turn off */
-    PORTB = PORTB & (~pin_ALL_INJECTORS_MASK);
 
-    /* tell user how many to go */
-    snprintf(buf, 17, "pulses left %d     ", pulses - p);
-    lcd.setCursor(0, 0);
-    lcd.println(buf);
-
-    delay(500);
+  /* pulse injectors, with half a second between the end of one pulse and the
+     start of the next */
+  pulse_engine_start(pulsewidth * TICKS_PER_US, (pulsewidth + 500000L) * TICKS_PER_US,
+                     selected_injectors(), pulses);
+
+  long shown = -1;
+  while (engine_running) {
+    long done = pulse_engine_pulse_count();
+    if (done != shown) {
+      shown = done;
+
+      /* tell user how many to go */
+      p = fmt_str(buf, "pulses left ");
+      p = fmt_int(p, pulses - done);
+      fmt_line(buf, p, 16);
+      lcd.setCursor(0, 0);
+      lcd.print(buf);
+    }
+    idle_sleep();
   }
+  pulse_engine_stop();
 
   /* Turn off fuel pump */
   digitalWrite(pin_FUEL_PUMP_RELAY, HIGH);
@@ -675,13 +2165,30 @@ void setup() {
   digitalWrite(pin_FUEL_PUMP_RELAY, HIGH);
 
   /* Make injector pins outputs */
-  DDRB = DDRB | dir_INJECTORS_OUT;  
+  INJECTORS::ddr() = INJECTORS::ddr() | INJECTORS::all;
+
+  /* Timer1 drives the injector and strobe edges */
+  timer1_setup();
+
+  /* Read the keypad in the background from now on */
+  keypad_start();
+#ifdef AWAKE_PROBE
+  DDRA = DDRA | pin_AWAKE_MASK;
+  PORTA = PORTA | pin_AWAKE_MASK;
+#endif
 
   set_top_line(CURRENT_MODE);
   set_bottom_line(CURRENT_MODE, NO_BUTTON);
 }
 
 void loop() {
+  /* Sleep until something happens. Unless a button is down, or was down last
+     time round, there's nothing to do */
+  idle_sleep();
+  if (LAST_BUTTON == NO_BUTTON && keypad_button == NO_BUTTON) {
+    return;
+  }
+
   /* check for button presses */
   button_t button = (button_t)get_button();
   if (LAST_BUTTON == button) {
@@ -692,9 +2199,10 @@ void loop() {
       unsigned long now = micros();     // time now
       unsigned long threshold = 300000; // threshold to generate another key press
       if ((CURRENT_MODE == PWM_MODE && PARAM_NUM == 1) ||
-          (CURRENT_MODE == RPM_MODE && PARAM_NUM == 2)) {
-        /* in PWM mode, adjust the ms parameter quicker, and in RPM mode
-           adjust the duty quicker */
+          (CURRENT_MODE == RPM_MODE && PARAM_NUM == 2) ||
+          (CURRENT_MODE == STROBE_MODE && PARAM_NUM == 0)) {
+        /* in PWM mode, adjust the ms parameter quicker, in RPM mode
+           adjust the duty quicker, and in strobe setup the delay */
         threshold = 100000;
       }
       if ((now - last_button_press_time) > threshold) {
@@ -734,6 +2242,9 @@ void loop() {
       switch(CURRENT_MODE) {
         case LEAK_TEST:
         case FULL_FLOW_MODE:
+        case CAPTURE_MODE:
+        case REPLAY_MODE:
+        case INJECTOR_MODE:
           PARAM_NUM = 0;
           break;
           ;;
@@ -742,6 +2253,8 @@ void loop() {
           break;
           ;;
         case PWM_MODE:
+        case TRIGGER_MODE:
+        case STROBE_MODE:
           PARAM_NUM = (PARAM_NUM + 1) % 2;
           break;
           ;;
@@ -771,6 +2284,26 @@ void loop() {
           pwm_mode_change_param(PARAM_NUM, increase);
           break;
           ;;
+      case TRIGGER_MODE:
+          trigger_mode_change_param(PARAM_NUM, increase);
+          break;
+          ;;
+      case CAPTURE_MODE:
+          capture_mode_change_param(PARAM_NUM, increase);
+          break;
+          ;;
+      case REPLAY_MODE:
+          /* nothing to set, it replays whatever was captured */
+          break;
+          ;;
+      case INJECTOR_MODE:
+          injector_mode_change_param(PARAM_NUM, increase);
+          break;
+          ;;
+      case STROBE_MODE:
+          strobe_mode_change_param(PARAM_NUM, increase);
+          break;
+          ;;
       }
     }
     else if (button == RIGHT) {
@@ -795,6 +2328,27 @@ void loop() {
           do_pwm_mode();
           break;
           ;;
+
+        case TRIGGER_MODE:
+          do_trigger_wheel_mode();
+          break;
+          ;;
+
+        case CAPTURE_MODE:
+          do_capture_mode();
+          break;
+          ;;
+
+        case REPLAY_MODE:
+          do_replay_mode();
+          break;
+          ;;
+
+        case INJECTOR_MODE:
+        case STROBE_MODE:
+          /* nothing to run, these set up the other modes */
+          break;
+          ;;
       }
     }
     set_top_line(CURRENT_MODE);